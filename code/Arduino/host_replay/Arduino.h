@@ -0,0 +1,67 @@
+// Minimal host-side stand-in for the Arduino core (ATmega2560 pin numbering)
+// used by code/replay_session.py to build and run sketches on a PC against recorded sessions.
+// Only the parts of the core used by the pneumatics sketches are provided.
+#ifndef host_arduino_h
+#define host_arduino_h
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <cstdlib>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+
+// (functions rather than the Arduino core's macros, so that standard headers included later still compile)
+using std::abs;
+template <typename T> inline T constrain(const T amt, const T low, const T high) {
+    return (amt < low) ? low : ((amt > high) ? high : amt);
+}
+
+// define analogue pin numbers as on the Arduino Mega
+const uint8_t A0 = 54, A1 = 55, A2 = 56, A3 = 57, A4 = 58, A5 = 59, A6 = 60, A7 = 61;
+const uint8_t A8 = 62, A9 = 63, A10 = 64, A11 = 65, A12 = 66, A13 = 67, A14 = 68, A15 = 69;
+
+//---PIN I/O AND TIMING (simulated clock; see host_replay.cpp for per-call costs)
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+void analogWrite(int pin, int value);
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+//---------------
+
+//---SERIAL PORT (input fed from recorded commands, output logged line by line)
+class HostSerial {
+public:
+    void begin(unsigned long baud);
+    int available();
+    int read();
+    size_t write(uint8_t c);
+
+    size_t print(const char text[]);
+    size_t print(char c);
+    size_t print(int value);
+    size_t print(unsigned int value);
+    size_t print(long value);
+    size_t print(unsigned long value);
+    size_t print(double value, int digits = 2);
+
+    size_t println();
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    size_t println(double value, int digits) { return print(value, digits) + println(); }
+};
+extern HostSerial Serial;
+//---------------
+
+#endif //host_arduino_h
@@ -0,0 +1,250 @@
+/* Host replay harness
+    runs a pneumatics sketch on a PC against a recorded session (see code/replay_session.py)
+
+  This file is not built on its own: replay_session.py generates a wrapper that includes Arduino.h,
+  the sketch (.ino), and then this file, so that recorded pressures can be converted to raw sensor
+  readings with the sketch's own pin assignments and calibration constants.
+
+  Replay events are read from stdin, one per line, sorted by time (in us):
+    S <time> <I|O> <sensor #> <pressure in kPa>   sets the pressure seen by a sensor
+    C <time> <text>                               sends text to the sketch over serial
+    X <time>                                      ends the replay
+  Results are written to stdout, one per line:
+    A <time> <pin> <value>                        pin output changed (digitalWrite or analogWrite)
+    L <time> <text>                               sketch printed a line over serial
+    R <loops> <simulated us> <host ns>            summary of loop() calls
+*/
+#include <stdio.h>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+// define simulated costs of core calls (in us), roughly matching an ATmega2560 at 16 MHz
+// (compute time between calls is not simulated; host ns per loop is reported separately)
+const unsigned long ANALOG_READ_US = 112;
+const unsigned long DIGITAL_WRITE_US = 5;
+const unsigned long ANALOG_WRITE_US = 8;
+const unsigned long LOOP_OVERHEAD_US = 10;
+const int SERIAL_TX_BUFFER_SIZE = 64;
+const int NUM_HOST_PINS = 70;
+const int UNSET_PIN_VALUE = -1;
+
+// define simulated board state
+unsigned long simMicros = 0;
+unsigned long serialByteMicros = 521; // 10 bits per byte at 19200 baud
+unsigned long serialTxFreeAt = 0;
+int pinValues[NUM_HOST_PINS];
+int analogInputs[NUM_HOST_PINS];
+std::deque<std::pair<unsigned long, char> > serialRx;
+unsigned long serialRxLastArrival = 0;
+std::string serialTxLine;
+HostSerial Serial;
+
+//---PIN I/O AND TIMING
+void log_pin_change(const int pin, const int value) {
+    if ((pin >= 0) && (pin < NUM_HOST_PINS) && (pinValues[pin] != value)) {
+        pinValues[pin] = value;
+        printf("A %lu %d %d\n", simMicros, pin, value);
+    }
+}
+void pinMode(int, int) {}
+void digitalWrite(int pin, int value) {
+    simMicros += DIGITAL_WRITE_US;
+    log_pin_change(pin, value ? HIGH : LOW);
+}
+int digitalRead(int pin) {
+    return ((pin >= 0) && (pin < NUM_HOST_PINS) && (pinValues[pin] > 0)) ? HIGH : LOW;
+}
+int analogRead(int pin) {
+    simMicros += ANALOG_READ_US;
+    return ((pin >= 0) && (pin < NUM_HOST_PINS)) ? analogInputs[pin] : 0;
+}
+void analogWrite(int pin, int value) {
+    simMicros += ANALOG_WRITE_US;
+    log_pin_change(pin, value);
+}
+long map(long x, long in_min, long in_max, long out_min, long out_max) {
+    return (x - in_min)*(out_max - out_min)/(in_max - in_min) + out_min;
+}
+unsigned long millis() { return simMicros/1000; }
+unsigned long micros() { return simMicros; }
+void delay(unsigned long ms) { simMicros += ms*1000; }
+void delayMicroseconds(unsigned int us) { simMicros += us; }
+//---------------
+
+//---SERIAL PORT
+void HostSerial::begin(unsigned long baud) {
+    serialByteMicros = 10000000UL/baud;
+}
+int HostSerial::available() {
+    int count = 0;
+    for (size_t i = 0; (i < serialRx.size()) && (serialRx[i].first <= simMicros); i++) {
+        count++;
+    }
+    return count;
+}
+int HostSerial::read() {
+    if ((serialRx.empty()) || (serialRx.front().first > simMicros)) {
+        return -1;
+    }
+    char c = serialRx.front().second;
+    serialRx.pop_front();
+    return c;
+}
+size_t HostSerial::write(uint8_t c) {
+    // block while transmit buffer is full, then queue byte behind any bytes still being sent
+    unsigned long buffer_full_until = serialTxFreeAt - (SERIAL_TX_BUFFER_SIZE - 1)*serialByteMicros;
+    if ((serialTxFreeAt > (SERIAL_TX_BUFFER_SIZE - 1)*serialByteMicros) && (simMicros < buffer_full_until)) {
+        simMicros = buffer_full_until;
+    }
+    serialTxFreeAt = ((serialTxFreeAt > simMicros) ? serialTxFreeAt : simMicros) + serialByteMicros;
+
+    // log each completed line of output
+    if (c == '\n') {
+        printf("L %lu %s\n", simMicros, serialTxLine.c_str());
+        serialTxLine.clear();
+    }
+    else if (c != '\r') {
+        serialTxLine += char(c);
+    }
+    return 1;
+}
+size_t HostSerial::print(const char text[]) {
+    size_t n = 0;
+    while (text[n] != '\0') {
+        write(text[n]);
+        n++;
+    }
+    return n;
+}
+size_t HostSerial::print(char c) { return write(c); }
+size_t HostSerial::print(int value) { return print(long(value)); }
+size_t HostSerial::print(unsigned int value) { return print((unsigned long)value); }
+size_t HostSerial::print(long value) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%ld", value);
+    return print(buffer);
+}
+size_t HostSerial::print(unsigned long value) {
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%lu", value);
+    return print(buffer);
+}
+size_t HostSerial::print(double value, int digits) {
+    char buffer[48];
+    snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+    return print(buffer);
+}
+size_t HostSerial::println() {
+    return write('\r') + write('\n');
+}
+//---------------
+
+//---REPLAY EVENTS
+struct ReplayEvent {
+    unsigned long time;
+    char type;
+    char side;
+    int index;
+    float pressure;
+    std::string text;
+};
+
+int pressure_to_raw_reading(const float pressure, const float calibration_offset) {
+    // invert calibrate_sensor_reading() to get the analogue reading the sketch would see
+    float sensor_volt = pressure/CALIBRATION_SCALE + calibration_offset;
+    long raw_value = lround(sensor_volt*1023.f/5.f);
+    return constrain(raw_value, 0L, 1023L);
+}
+void set_sensor_pressure(const char side, const int sensor_ind, const float pressure) {
+    if ((side == 'I') && (sensor_ind >= 0) && (sensor_ind < NUM_IN_SENSORS)) {
+        analogInputs[IN_SENSOR_PINS[sensor_ind]] = pressure_to_raw_reading(pressure, IN_CALIBRATION_OFFSETS[sensor_ind]);
+    }
+    else if ((side == 'O') && (sensor_ind >= 0) && (sensor_ind < NUM_OUT_SENSORS)) {
+        analogInputs[OUT_SENSOR_PINS[sensor_ind]] = pressure_to_raw_reading(pressure, OUT_CALIBRATION_OFFSETS[sensor_ind]);
+    }
+}
+void queue_serial_input(const unsigned long time, const std::string &text) {
+    // bytes arrive one at a time at the configured baud rate
+    unsigned long arrival = (time > serialRxLastArrival) ? time : serialRxLastArrival;
+    for (size_t i = 0; i < text.size(); i++) {
+        arrival += serialByteMicros;
+        serialRx.push_back(std::make_pair(arrival, text[i]));
+    }
+    serialRxLastArrival = arrival;
+}
+bool read_replay_events(std::vector<ReplayEvent> &events) {
+    char line[256];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        ReplayEvent event;
+        event.type = line[0];
+        event.side = ' ';
+        event.index = 0;
+        event.pressure = 0.f;
+        int text_start = 0;
+        if ((event.type == 'S') && (sscanf(line, "S %lu %c %d %f", &event.time, &event.side, &event.index, &event.pressure) == 4)) {
+            events.push_back(event);
+        }
+        else if ((event.type == 'C') && (sscanf(line, "C %lu %n", &event.time, &text_start) == 1)) {
+            // keep command text verbatim (including trailing newline sent by PneumaticConnection)
+            event.text = std::string(line + text_start);
+            events.push_back(event);
+        }
+        else if ((event.type == 'X') && (sscanf(line, "X %lu", &event.time) == 1)) {
+            events.push_back(event);
+        }
+        else {
+            fprintf(stderr, "Invalid replay event: %s", line);
+            return false;
+        }
+    }
+    return true;
+}
+//---------------
+
+int main() {
+    std::vector<ReplayEvent> events;
+    if (!read_replay_events(events)) {
+        return 1;
+    }
+    for (int i = 0; i < NUM_HOST_PINS; i++) {
+        pinValues[i] = UNSET_PIN_VALUE;
+        analogInputs[i] = 0;
+    }
+
+    // sensors read atmospheric pressure until their first recorded sample
+    for (int i = 0; i < NUM_IN_SENSORS; i++) {
+        set_sensor_pressure('I', i, 0.f);
+    }
+    for (int i = 0; i < NUM_OUT_SENSORS; i++) {
+        set_sensor_pressure('O', i, 0.f);
+    }
+
+    // run sketch, applying replay events as the simulated clock reaches them
+    setup();
+    unsigned long end_time = events.empty() ? 0 : events.back().time;
+    unsigned long loop_count = 0;
+    size_t next_event = 0;
+    std::chrono::steady_clock::duration host_time(0);
+    while (simMicros < end_time) {
+        while ((next_event < events.size()) && (events[next_event].time <= simMicros)) {
+            const ReplayEvent &event = events[next_event];
+            if (event.type == 'S') {
+                set_sensor_pressure(event.side, event.index, event.pressure);
+            }
+            else if (event.type == 'C') {
+                queue_serial_input(event.time, event.text);
+            }
+            next_event++;
+        }
+        std::chrono::steady_clock::time_point loop_start = std::chrono::steady_clock::now();
+        loop();
+        host_time += std::chrono::steady_clock::now() - loop_start;
+        simMicros += LOOP_OVERHEAD_US;
+        loop_count++;
+    }
+    long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(host_time).count();
+    printf("R %lu %lu %lld\n", loop_count, simMicros, host_ns);
+    return 0;
+}
@@ -77,11 +77,35 @@ enum output_sensors{
     OS8
 };
 
+// define constants for valve drive (hit-and-hold: full-on pull-in pulse, then PWM hold level)
+// driven valve indices cover input valves first, then output valves
+const int NUM_DRIVEN_VALVES = NUM_IN_VALVES + NUM_OUT_VALVES;
+const unsigned long VALVE_PULL_IN_US = 20000;   // length of full-on pulse to open valve
+const unsigned long VALVE_STAGGER_US = 250;     // minimum spacing between valve pull-in starts (caps inrush current)
+const unsigned int VALVE_TICK_US = 100;         // hold PWM timer tick (10 kHz)
+const byte VALVE_PWM_STEPS = 10;                // ticks per hold PWM period (1 kHz)
+const byte VALVE_HOLD_STEPS = 5;                // ticks on per hold PWM period (50% hold level)
+enum valve_drive_states{
+    DRIVE_OFF = 0,
+    DRIVE_PULL_IN,
+    DRIVE_HOLD
+};
+
 // define pressure sensor calibration parameters
 const float CALIBRATION_SCALE = 50.f;
 const float IN_CALIBRATION_OFFSETS[NUM_IN_SENSORS] = {2.519,2.512}; // in V
 const float OUT_CALIBRATION_OFFSETS[NUM_OUT_SENSORS] = {2.516,2.5,2.5,2.5,2.5,2.5,2.5,2.5}; // in V
 
+// define constants for pressure watches (conditions checked every control cycle)
+const int MAX_WATCHES = 8;
+const int NO_FREE_WATCH = -1;
+const float WATCH_VALUE_SCALE = 10.f; // watch thresholds and tolerances are sent in tenths of kPa
+enum watch_conditions{
+    WATCH_RISE = 0, // fires when pressure rises to or above threshold
+    WATCH_FALL,     // fires when pressure falls to or below threshold
+    WATCH_BAND      // fires when reservoir pressure is within tolerance of pump setpoint
+};
+
 // define serial command string format
 namespace serial_command{
     // define serial markers and max length
@@ -103,6 +127,16 @@ namespace serial_command{
     const char GET_REF_SETPOINT[] = "RG";       // command format: <RG, pump #, 999>
     const char SET_PUMP_STATE[] = "PS";         // command format: <PS, pump #, pump state>
     const char GET_PUMP_STATE[] = "PG";         // command format: <PG, pump #, 999>
+    const char WATCH_IN_PRESSURE[] = "WI";      // command format: <WI, sensor #, threshold in 0.1 kPa>
+    const char WATCH_OUT_PRESSURE[] = "WO";     // command format: <WO, sensor #, threshold in 0.1 kPa>
+    const char WATCH_SETPOINT[] = "WS";         // command format: <WS, pump #, tolerance in 0.1 kPa>
+    const char CANCEL_WATCH[] = "WC";           // command format: <WC, watch #, 999>
+    const char GET_IN_VALVE_TIMES[] = "TI";     // command format: <TI, valve #, 999>
+    const char GET_OUT_VALVE_TIMES[] = "TO";    // command format: <TO, valve #, 999>
+
+    // define prefix for unsolicited watch notifications sent to PC
+    // (notification format: !W,watch #,pressure)
+    const char WATCH_NOTIFY_PREFIX[] = "!W";
 
     // define integers for first letter of serial commands
     // (used to determine action based on command)
@@ -112,6 +146,8 @@ namespace serial_command{
     const int GET_VALVE_STATE_PREFIX = 'V';     // should match first letter of GET_IN_VALVE_STATE & GET_OUT_VALVE_STATE
     const int REF_SETPOINT_PREFIX = 'R';        // should match first letter of SET_REF_SETPOINT & GET_REF_SETPOINT
     const int PUMP_STATE_PREFIX = 'P';          // should match first letter of SET_PUMP_STATE & GET_PUMP_STATE
+    const int WATCH_PREFIX = 'W';               // should match first letter of all watch commands
+    const int VALVE_TIMES_PREFIX = 'T';         // should match first letter of GET_IN_VALVE_TIMES & GET_OUT_VALVE_TIMES
 
     // define integers for second letter of serial commands
     // (used to determine whether action is taken on input or output channels for valves and sensors
@@ -120,6 +156,7 @@ namespace serial_command{
     const int OUTPUT_SUFFIX = 'O';              // should match second letter of valve and pressure sensor commands
     const int SET_SUFFIX = 'S';                 // should match second letter of pump and reference setpoint commands
     const int GET_SUFFIX = 'G';                 // should match second letter of pump and reference setpoint commands
+    const int CANCEL_SUFFIX = 'C';              // should match second letter of CANCEL_WATCH
 } //namespace serial_command
 
 // define (global) variables for serial communication
@@ -134,6 +171,13 @@ int pumpStates[NUM_PUMPS] = {PUMP_OFF, PUMP_OFF};
 int inputValveStates[NUM_IN_VALVES];
 int outputValveStates[NUM_OUT_VALVES];
 
+// define variables to hold valve drive states and open/close timestamps (from micros())
+int valveDriveStates[NUM_DRIVEN_VALVES] = {DRIVE_OFF};
+unsigned long valveOpenTimes[NUM_DRIVEN_VALVES] = {0};
+unsigned long valveCloseTimes[NUM_DRIVEN_VALVES] = {0};
+unsigned long lastPullInTime = 0;
+volatile bool valveHoldActive[NUM_DRIVEN_VALVES] = {false};
+
 // define variables to hold sensor pressure readings and pump setpoint values
 int inputPressureRawReadings[NUM_IN_SENSORS];
 int outputPressureRawReadings[NUM_OUT_SENSORS];
@@ -143,6 +187,142 @@ float inputPressureValsAverage[NUM_IN_SENSORS];
 float outputPressureValsAverage[NUM_OUT_SENSORS];
 int pumpSetpoints[NUM_PUMPS] = {0, 0};
 
+// define variables to hold pressure watch slots
+bool watchActive[MAX_WATCHES] = {false};
+int watchSide[MAX_WATCHES];         // serial_command::INPUT_SUFFIX or serial_command::OUTPUT_SUFFIX
+int watchSensorIndex[MAX_WATCHES];
+int watchCondition[MAX_WATCHES];
+float watchThreshold[MAX_WATCHES];  // in kPa (threshold for crossings, tolerance for WATCH_BAND)
+
+//---VALVE DRIVE (HIT-AND-HOLD)
+int get_driven_valve_pin(const int drive_ind) {
+    if (drive_ind < NUM_IN_VALVES) {
+        return IN_VALVE_PINS[drive_ind];
+    }
+    return OUT_VALVE_PINS[drive_ind - NUM_IN_VALVES];
+}
+#if defined(__AVR__)
+// only pins 44-46 have hardware PWM on the Mega, so hold level is generated in software from Timer3
+// (Timer3 otherwise only drives PWM on pins 2, 3, and 5, which are unused)
+volatile uint8_t *valvePortRegisters[NUM_DRIVEN_VALVES];
+uint8_t valvePinMasks[NUM_DRIVEN_VALVES];
+volatile byte valvePwmPhase = 0;
+int numValvesHolding = 0;
+
+void initialize_valve_drive() {
+    for (int i = 0; i < NUM_DRIVEN_VALVES; i++) {
+        int pin = get_driven_valve_pin(i);
+        valvePortRegisters[i] = portOutputRegister(digitalPinToPort(pin));
+        valvePinMasks[i] = digitalPinToBitMask(pin);
+    }
+
+    // set Timer3 to CTC mode with prescaler of 8 and compare match every VALVE_TICK_US
+    // (interrupt is only enabled while a valve is at hold level; see set_valve_hold)
+    noInterrupts();
+    TCCR3A = 0;
+    TCCR3B = _BV(WGM32) | _BV(CS31);
+    TCNT3 = 0;
+    OCR3A = (F_CPU/8/1000000UL)*VALVE_TICK_US - 1;
+    TIMSK3 = 0;
+    interrupts();
+}
+ISR(TIMER3_COMPA_vect) {
+    // switch holding valves on at start of PWM period and off after VALVE_HOLD_STEPS ticks
+    byte pwm_phase = valvePwmPhase;
+    if ((pwm_phase == 0) || (pwm_phase == VALVE_HOLD_STEPS)) {
+        for (int i = 0; i < NUM_DRIVEN_VALVES; i++) {
+            if (valveHoldActive[i]) {
+                if (pwm_phase == 0) {
+                    *valvePortRegisters[i] |= valvePinMasks[i];
+                }
+                else {
+                    *valvePortRegisters[i] &= ~valvePinMasks[i];
+                }
+            }
+        }
+    }
+    pwm_phase++;
+    if (pwm_phase >= VALVE_PWM_STEPS) {
+        pwm_phase = 0;
+    }
+    valvePwmPhase = pwm_phase;
+}
+void set_valve_hold(const int drive_ind, const bool hold) {
+    if (valveHoldActive[drive_ind] == hold) {
+        return;
+    }
+    valveHoldActive[drive_ind] = hold;
+
+    // run timer interrupt only while at least one valve is at hold level
+    if (hold) {
+        numValvesHolding++;
+        if (numValvesHolding == 1) {
+            noInterrupts();
+            valvePwmPhase = 0;
+            TCNT3 = 0;
+            TIFR3 = _BV(OCF3A); // clear any stale compare match before enabling interrupt
+            TIMSK3 |= _BV(OCIE3A);
+            interrupts();
+        }
+    }
+    else {
+        numValvesHolding--;
+        if (numValvesHolding == 0) {
+            TIMSK3 &= ~_BV(OCIE3A);
+        }
+    }
+}
+#else
+// host builds (see host_replay) have no timer interrupts, so hold level is shown as an analogue output
+void initialize_valve_drive() {}
+void set_valve_hold(const int drive_ind, const bool hold) {
+    valveHoldActive[drive_ind] = hold;
+    if (hold) {
+        analogWrite(get_driven_valve_pin(drive_ind), (VALVE_HOLD_STEPS*255)/VALVE_PWM_STEPS);
+    }
+}
+#endif
+void set_driven_valve(const int drive_ind, const int next_valve_state) {
+    int pin = get_driven_valve_pin(drive_ind);
+    if (next_valve_state == VALVE_OPEN) {
+        if (valveDriveStates[drive_ind] != DRIVE_OFF) {
+            return;
+        }
+
+        // space out pull-in pulses so that valves opened together do not all draw inrush current at once
+        unsigned long since_last_pull_in = micros() - lastPullInTime;
+        if (since_last_pull_in < VALVE_STAGGER_US) {
+            delayMicroseconds(VALVE_STAGGER_US - since_last_pull_in);
+        }
+
+        // start full-on pull-in pulse (hold level is set later by update_valve_drive)
+        digitalWrite(pin, HIGH);
+        lastPullInTime = micros();
+        valveOpenTimes[drive_ind] = lastPullInTime;
+        valveDriveStates[drive_ind] = DRIVE_PULL_IN;
+    }
+    else {
+        // stop hold PWM before driving pin low so timer cannot switch valve back on
+        set_valve_hold(drive_ind, false);
+        digitalWrite(pin, LOW);
+        if (valveDriveStates[drive_ind] != DRIVE_OFF) {
+            valveCloseTimes[drive_ind] = micros();
+        }
+        valveDriveStates[drive_ind] = DRIVE_OFF;
+    }
+}
+void update_valve_drive() {
+    // drop valves to hold level once pull-in pulse has finished
+    unsigned long now = micros();
+    for (int i = 0; i < NUM_DRIVEN_VALVES; i++) {
+        if ((valveDriveStates[i] == DRIVE_PULL_IN) && (now - valveOpenTimes[i] >= VALVE_PULL_IN_US)) {
+            valveDriveStates[i] = DRIVE_HOLD;
+            set_valve_hold(i, true);
+        }
+    }
+}
+//---------------
+
 //----ARDUINO INITIALIZATION
 void initialize_pins() {
     // set up pump pins as Arduino outputs
@@ -168,30 +348,52 @@ void initialize_pins() {
     for (int i = 0; i < NUM_OUT_SENSORS ; i++) {
         pinMode(OUT_SENSOR_PINS[i], INPUT);
     }
+
+    // set up timer for valve hold PWM
+    initialize_valve_drive();
 }
 //---------------
 
 //---VALVE CONTROL FUNCTIONS
 void set_invalve_all(const int next_valve_state) {
     for (int i = 0; i < NUM_IN_VALVES; i++) {
-      digitalWrite(IN_VALVE_PINS[i], next_valve_state);
+      set_driven_valve(i, next_valve_state);
       inputValveStates[i] = next_valve_state;
     }
 }
 void set_invalve_single(const int valve_ind, const int next_valve_state) {
-    digitalWrite(IN_VALVE_PINS[valve_ind], next_valve_state);
+    // ignore out-of-range valve indices (drive arrays are shared with output valves and read by Timer3 ISR)
+    if ((valve_ind < 0) || (valve_ind >= NUM_IN_VALVES)) {
+        return;
+    }
+    set_driven_valve(valve_ind, next_valve_state);
     inputValveStates[valve_ind] = next_valve_state;
 }
 void set_outvalve_all(const int next_valve_state) {
     for (int i = 0; i < NUM_OUT_VALVES; i++) {
-      digitalWrite(OUT_VALVE_PINS[i], next_valve_state);
+      set_driven_valve(NUM_IN_VALVES + i, next_valve_state);
       outputValveStates[i] = next_valve_state;
     }
 }
 void set_outvalve_single(const int valve_ind, const int next_valve_state) {
-    digitalWrite(OUT_VALVE_PINS[valve_ind], next_valve_state);
+    if ((valve_ind < 0) || (valve_ind >= NUM_OUT_VALVES)) {
+        return;
+    }
+    set_driven_valve(NUM_IN_VALVES + valve_ind, next_valve_state);
     outputValveStates[valve_ind] = next_valve_state;
 }
+void print_valve_times(const int side, const int valve_ind) {
+    // always reply, so that PC is not left waiting on an invalid valve index
+    int num_valves = (side == serial_command::INPUT_SUFFIX) ? NUM_IN_VALVES : NUM_OUT_VALVES;
+    if ((valve_ind < 0) || (valve_ind >= num_valves)) {
+        Serial.println("Invalid valve index!");
+        return;
+    }
+    int drive_ind = (side == serial_command::INPUT_SUFFIX) ? valve_ind : NUM_IN_VALVES + valve_ind;
+    Serial.print(valveOpenTimes[drive_ind]);
+    Serial.print(',');
+    Serial.println(valveCloseTimes[drive_ind]);
+}
 //-------
 
 //---PRESSURE SENSOR INPUTS AND CALIBRATION
@@ -239,6 +441,88 @@ void set_pump_setpoint(const int pump_ind, const int next_setpoint) {
 }
 //---------------
 
+//---PRESSURE WATCHES (ASYNCHRONOUS THRESHOLD NOTIFICATIONS)
+float get_average_pressure(const int side, const int sensor_ind) {
+    if (side == serial_command::INPUT_SUFFIX) {
+        return inputPressureValsAverage[sensor_ind];
+    }
+    return outputPressureValsAverage[sensor_ind];
+}
+int add_watch(const int side, const int sensor_ind, const int condition, const float threshold) {
+    // reject sensor indices that would be read out of bounds on every control cycle
+    int num_sensors = (side == serial_command::INPUT_SUFFIX) ? NUM_IN_SENSORS : NUM_OUT_SENSORS;
+    if ((sensor_ind < 0) || (sensor_ind >= num_sensors)) {
+        return NO_FREE_WATCH;
+    }
+
+    // store watch in first free slot
+    for (int i = 0; i < MAX_WATCHES; i++) {
+        if (!watchActive[i]) {
+            watchSide[i] = side;
+            watchSensorIndex[i] = sensor_ind;
+            watchCondition[i] = condition;
+            watchThreshold[i] = threshold;
+            watchActive[i] = true;
+            return i;
+        }
+    }
+    return NO_FREE_WATCH;
+}
+int add_crossing_watch(const int side, const int sensor_ind, const int threshold_tenths) {
+    // watch for pressure crossing threshold from whichever side it is currently on
+    float threshold = threshold_tenths/WATCH_VALUE_SCALE;
+    int condition = WATCH_RISE;
+    int num_sensors = (side == serial_command::INPUT_SUFFIX) ? NUM_IN_SENSORS : NUM_OUT_SENSORS;
+    if ((sensor_ind >= 0) && (sensor_ind < num_sensors) && (get_average_pressure(side, sensor_ind) > threshold)) {
+        condition = WATCH_FALL;
+    }
+    return add_watch(side, sensor_ind, condition, threshold);
+}
+int add_setpoint_watch(const int pump_ind, const int tolerance) {
+    // pump indices match input sensor indices (NEG = INS_NEG, POS = INS_POS)
+    return add_watch(serial_command::INPUT_SUFFIX, pump_ind, WATCH_BAND, tolerance/WATCH_VALUE_SCALE);
+}
+void cancel_watch(const int watch_ind) {
+    // out-of-range watch index (e.g., 999) cancels all watches
+    if ((watch_ind >= 0) && (watch_ind < MAX_WATCHES)) {
+        watchActive[watch_ind] = false;
+    }
+    else {
+        for (int i = 0; i < MAX_WATCHES; i++) {
+            watchActive[i] = false;
+        }
+    }
+}
+void check_watches() {
+    float pressure;
+    bool fired;
+    for (int i = 0; i < MAX_WATCHES; i++) {
+        if (!watchActive[i]) {
+            continue;
+        }
+
+        // evaluate watch condition against current running average
+        pressure = get_average_pressure(watchSide[i], watchSensorIndex[i]);
+        switch(watchCondition[i]){
+            case (WATCH_RISE): fired = (pressure >= watchThreshold[i]); break;
+            case (WATCH_FALL): fired = (pressure <= watchThreshold[i]); break;
+            case (WATCH_BAND): fired = (abs(pressure - pumpSetpoints[watchSensorIndex[i]]) <= watchThreshold[i]); break;
+            default: fired = false;
+        }
+
+        // send single notification and free watch slot
+        if (fired) {
+            watchActive[i] = false;
+            Serial.print(serial_command::WATCH_NOTIFY_PREFIX);
+            Serial.print(',');
+            Serial.print(i);
+            Serial.print(',');
+            Serial.println(pressure);
+        }
+    }
+}
+//---------------
+
 //---RECEIVE, PARSE, and ACT ON A SERIAL COMMAND INPUT
 void recv_serial_command() {
     // if this is the first function call, initialize serial input state variable & index
@@ -281,16 +565,17 @@ void parse_command_data() {
     char * strtokIndex;
 
     // get command string from serial input and copy to global variable
+    // (missing fields, e.g. from a command with no commas, are treated as empty/zero)
     strtokIndex = strtok(receivedChars, ",");
-    strcpy(serialCommand, strtokIndex);
+    strcpy(serialCommand, (strtokIndex != NULL) ? strtokIndex : "");
 
     // get pin index from serial input and copy to global variable as integer
     strtokIndex = strtok(NULL, ",");
-    serialIndex = atoi(strtokIndex);
+    serialIndex = (strtokIndex != NULL) ? atoi(strtokIndex) : 0;
 
     // get command value from serial input and copy to global variable as integer
     strtokIndex = strtok(NULL, ",");
-    serialValue = atoi(strtokIndex);
+    serialValue = (strtokIndex != NULL) ? atoi(strtokIndex) : 0;
 
     // mark serial data input completed
     newSerialInputReady = false;
@@ -306,6 +591,8 @@ bool verify_command_validity(int prefix, int suffix){
         case (serial_command::GET_VALVE_STATE_PREFIX): break;   // V
         case (serial_command::REF_SETPOINT_PREFIX): break;      // R
         case (serial_command::PUMP_STATE_PREFIX): break;        // P
+        case (serial_command::WATCH_PREFIX): break;             // W
+        case (serial_command::VALVE_TIMES_PREFIX): break;       // T
         default:
             Serial.print("Invalid serial command prefix! Received: ");
             Serial.print(char(prefix));
@@ -319,6 +606,7 @@ bool verify_command_validity(int prefix, int suffix){
             case (serial_command::OUTPUT_SUFFIX): break;    // O
             case (serial_command::SET_SUFFIX): break;       // S
             case (serial_command::GET_SUFFIX): break;       // G
+            case (serial_command::CANCEL_SUFFIX): break;    // C
             default:
                 Serial.print("Invalid serial command suffix! Received: ");
                 Serial.print(char(prefix));
@@ -331,8 +619,8 @@ bool verify_command_validity(int prefix, int suffix){
  
 void act_on_command() {
     // pull letters of serial command into separate variables
-    int command_prefix = serialCommand[0]; // should be S, A, G, V, R, or P
-    int command_suffix = serialCommand[1]; // should be I or O (input or output) or S or G (set or get)
+    int command_prefix = serialCommand[0]; // should be S, A, G, V, R, P, W, or T
+    int command_suffix = serialCommand[1]; // should be I or O (input or output), S or G (set or get), or C (cancel)
 
     // if prefix and suffix letters are valid, recognized commands, carry out command
     if (verify_command_validity(command_prefix,command_suffix)){
@@ -385,6 +673,22 @@ void act_on_command() {
                     Serial.println(pumpStates[serialIndex]);
                 }
                 break;
+            case (serial_command::WATCH_PREFIX): // W
+                if ((command_suffix == serial_command::INPUT_SUFFIX) || (command_suffix == serial_command::OUTPUT_SUFFIX)) {
+                    Serial.println(add_crossing_watch(command_suffix, serialIndex, serialValue));
+                }
+                else if (command_suffix == serial_command::SET_SUFFIX) {
+                    Serial.println(add_setpoint_watch(serialIndex, serialValue));
+                }
+                else if (command_suffix == serial_command::CANCEL_SUFFIX) {
+                    cancel_watch(serialIndex);
+                }
+                break;
+            case (serial_command::VALVE_TIMES_PREFIX): // T
+                if ((command_suffix == serial_command::INPUT_SUFFIX) || (command_suffix == serial_command::OUTPUT_SUFFIX)) {
+                    print_valve_times(command_suffix, serialIndex);
+                }
+                break;
             default:
                 Serial.println("Serial command validity check failed!");
         }
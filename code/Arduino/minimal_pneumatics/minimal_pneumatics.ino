@@ -34,6 +34,8 @@ void loop() {
         parse_command_data();
         act_on_command();   // based on input command, open/close valves or change pump setpoints
     }
+    // switch valves from pull-in pulse to hold level
+    update_valve_drive();
     // regulate input channel pressures to current setpoints
     pressure_control(pump_duty_cycle);
 }
@@ -51,6 +53,9 @@ void pressure_control(int pump_dutycycle) {
         outputPressureValsAverage[i] = (outputPressureValsAverage[i] + 99.f*updated_pressure_val)/100.f;
     }
 
+    // notify PC of any pressure watches whose conditions are now met
+    check_watches();
+
     // control negative reservoir pump state based on average negative input channel pressure values
     neg_pressure_running_avg = inputPressureValsAverage[input_sensors::INS_NEG];
     neg_pressure_setpoint = pumpSetpoints[pumps::NEG];
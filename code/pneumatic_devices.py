@@ -5,12 +5,22 @@ Updated: 2024-02-18
 
 Defines object for pneumatic device control communication.
 '''
+import asyncio
+import collections
+import queue
 import serial
+import threading
 import time
+import traceback
+
+from pneumatic_recording import read_recording, RECORDING_MAGIC, RECORDING_VERSION, RECORDING_HEADER, RECORD_HEADER, \
+                                REC_COMMAND, REC_REPLY, REC_NOTIFY
 
 class PneumaticConnection:
     TERMINATOR = '\r'.encode('UTF8')
     FILLER_STRING = 99
+    WATCH_NOTIFY_PREFIX = "!W"  # unsolicited notification format: !W,watch #,pressure
+    WATCH_VALUE_SCALE = 10      # watch thresholds and tolerances are sent in tenths of kPa
     
     def __init__(self, device='COM7', baud=19200, timeout=1):
         self.serial = serial.Serial(device, baud, timeout=timeout)
@@ -21,6 +31,28 @@ class PneumaticConnection:
         self.base_out_string = "OUT"
         self.ON,self.OFF = True,False
         self.OPEN,self.CLOSED = True,False
+        self.recording_file = None
+        self.recording_start_time = 0
+        self.record_lock = threading.Lock()
+
+        # watches are tracked by host-side handles (device slots are reused as soon as a watch fires)
+        self.watch_lock = threading.Lock()
+        self.next_watch_handle = 0
+        self.watch_slots = {}       # device slot -> handle of active watch (None if registration timed out)
+        self.watches = {}           # handle -> WatchState
+        self.pending_watches = collections.deque()  # (command echo, handle) awaiting slot number, in order sent
+
+        # single background reader owns the serial port: replies go to queue, notifications to watches
+        # (watch callbacks run on a separate dispatcher thread so that they can send commands;
+        #  command_lock keeps each command and its replies together across threads)
+        self.replies = queue.Queue()
+        self.command_lock = threading.RLock()
+        self.callback_tasks = queue.Queue()
+        self.reading = True
+        self.reader_thread = threading.Thread(target=self.read_serial, daemon=True)
+        self.reader_thread.start()
+        self.dispatch_thread = threading.Thread(target=self.dispatch_callbacks, daemon=True)
+        self.dispatch_thread.start()
 
     def set_indices(self,valves,sensors,pumps):
         self.valves = valves
@@ -40,14 +72,104 @@ class PneumaticConnection:
         return command_string 
 
     def receive(self) -> str:
-        line = self.serial.read_until(self.TERMINATOR)
-        return line.decode('UTF8').strip()
+        # returns next reply (or command echo) from reader thread, or empty string on timeout
+        try:
+            return self.replies.get(timeout=self.serial.timeout)
+        except queue.Empty:
+            return ''
+
+    def read_serial(self):
+        # runs in background thread until connection is closed
+        while self.reading:
+            try:
+                line = self.serial.read_until(self.TERMINATOR).decode('UTF8').strip()
+            except (serial.SerialException, OSError):
+                break
+            if not line:
+                continue
+            if line.startswith(self.WATCH_NOTIFY_PREFIX):
+                self.record(REC_NOTIFY, line)
+                self.handle_notification(line)
+            else:
+                self.record(REC_REPLY, line)
+                if not self.claim_watch_slot(line):
+                    self.replies.put(line)
+
+    def dispatch_callbacks(self):
+        # runs in background thread until connection is closed (None task)
+        while True:
+            task = self.callback_tasks.get()
+            if task is None:
+                return
+            try:
+                task()
+            except Exception:
+                print("Exception in watch callback:")
+                traceback.print_exc()
+
+    def claim_watch_slot(self, line:str) -> bool:
+        # map slot number in a watch registration reply to its handle before any later notification is read;
+        # returns True if line belongs to a timed-out registration (nobody is waiting to receive it)
+        with self.watch_lock:
+            if not self.pending_watches:
+                return False
+            echo,handle = self.pending_watches[0]
+            if line == echo:
+                return handle is None
+            self.pending_watches.popleft()
+            try:
+                slot = int(line)
+            except ValueError:
+                return False
+            if slot >= 0:
+                self.watch_slots[slot] = handle
+                if handle is not None:
+                    self.watches[handle].slot = slot
+        if handle is None and slot >= 0:
+            self.callback_tasks.put(lambda: self.cancel_orphaned_watch(slot))
+        return handle is None
+
+    def cancel_orphaned_watch(self, slot:int):
+        # cancel device-side watch whose registration timed out on the host (unless it already fired)
+        CANCEL_WATCH = "WC"         # command format: <WC, watch #, 999>
+        with self.command_lock:
+            with self.watch_lock:
+                if slot not in self.watch_slots or self.watch_slots[slot] is not None:
+                    return
+                del self.watch_slots[slot]
+            self.send(self.assemble_command(CANCEL_WATCH,id=slot))
+
+    def handle_notification(self, line:str):
+        try:
+            _,slot,pressure = line.split(',')
+            slot,pressure = int(slot),float(pressure)
+        except ValueError:
+            print("Malformed watch notification from Arduino: %s" %(line))
+            return
+
+        # ignore notifications for watches cancelled on the host
+        # (watches with a callback are forgotten once fired; the callback receives the pressure)
+        with self.watch_lock:
+            handle = self.watch_slots.pop(slot, None)
+            watch = self.watches.get(handle)
+            if watch is not None and watch.callback is not None:
+                del self.watches[handle]
+        if watch is not None and watch.fire(pressure) and watch.callback is not None:
+            self.callback_tasks.put(lambda: watch.callback(watch.handle, pressure))
 
     def send(self, text:str) -> bool:
         line = '%s\n'%(text)
-        self.serial.write(line.encode('UTF8'))
-        echo = self.receive()
+        with self.command_lock:
+            self.record(REC_COMMAND, line)
+            self.serial.write(line.encode('UTF8'))
+            echo = self.receive()
         return text == echo
+
+    def query(self, text:str) -> str:
+        # send command and return the reply that follows its echo
+        with self.command_lock:
+            self.send(text)
+            return self.receive()
     
     def set_single_valve(self,valve_string,valve_state):
         # define serial commands and get command string
@@ -90,6 +212,25 @@ class PneumaticConnection:
         full_command = self.assemble_command(command_str,id=valve_id)
         self.send(full_command)
 
+    def get_valve_times(self,valve_string):
+        # define serial commands and get command string
+        GET_IN_VALVE_TIMES = "TI"  # command format: <TI, valve #, 999>
+        GET_OUT_VALVE_TIMES = "TO" # command format: <TO, valve #, 999>
+        if valve_string in self.input_strings:
+            command_str = GET_IN_VALVE_TIMES
+        else:
+            command_str = GET_OUT_VALVE_TIMES
+
+        # send serial command; returns Arduino micros() timestamps of last valve open and close
+        valve_id = self.valves[valve_string]
+        full_command = self.assemble_command(command_str,id=valve_id)
+        times_reply = self.query(full_command)
+        times = times_reply.split(',')
+        if len(times) != 2 or not all(t.isdigit() for t in times):
+            print("Valve times not returned by Arduino (timeout or invalid valve index)! Received: %s" %(times_reply))
+            raise RuntimeError
+        return int(times[0]),int(times[1])
+
     def get_pressure_value(self,sensor_string):
         # define serial commands and get command string
         GET_IN_PRESSURE = "GI"      # command format: <GI, sensor #, 999>
@@ -102,8 +243,7 @@ class PneumaticConnection:
         # send serial command
         sensor_id = self.sensors[sensor_string]
         full_command = self.assemble_command(command_str,id=sensor_id)
-        self.send(full_command)
-        return self.receive()
+        return self.query(full_command)
     
     def set_reference_setpoint(self,pump_string,pump_setpt):
         # define serial commands and get command string
@@ -152,6 +292,123 @@ class PneumaticConnection:
             print("Positive pump pressure: {0}\nNegative pump pressure: {1}".format(neg_pump_pressure,pos_pump_pressure))
         return [neg_pump_pressure,pos_pump_pressure]
 
+    def add_pressure_watch(self,sensor_string,threshold,callback=None) -> int:
+        # callback(handle, pressure) runs on the dispatcher thread once the watch fires and may send commands
+        # (a watch with a callback is forgotten once fired, so wait_for_watch() then returns None)
+        # define serial commands and get command string
+        WATCH_IN_PRESSURE = "WI"    # command format: <WI, sensor #, threshold in 0.1 kPa>
+        WATCH_OUT_PRESSURE = "WO"   # command format: <WO, sensor #, threshold in 0.1 kPa>
+        if sensor_string in self.input_strings:
+            command_str = WATCH_IN_PRESSURE
+        else:
+            command_str = WATCH_OUT_PRESSURE
+
+        # send serial command and register callback for returned watch handle
+        sensor_id = self.sensors[sensor_string]
+        threshold_val = int(round(threshold*self.WATCH_VALUE_SCALE))
+        full_command = self.assemble_command(command_str,id=sensor_id,val=threshold_val)
+        return self.register_watch(full_command, callback)
+
+    def add_setpoint_watch(self,pump_string,tolerance,callback=None) -> int:
+        # callback(handle, pressure) runs on the dispatcher thread once the watch fires and may send commands
+        # (a watch with a callback is forgotten once fired, so wait_for_watch() then returns None)
+        # define serial commands and get command string
+        WATCH_SETPOINT = "WS"       # command format: <WS, pump #, tolerance in 0.1 kPa>
+        command_str = WATCH_SETPOINT
+        pump_id = self.pumps[pump_string]
+
+        # send serial command and register callback for returned watch handle
+        tolerance_val = int(round(tolerance*self.WATCH_VALUE_SCALE))
+        full_command = self.assemble_command(command_str,id=pump_id,val=tolerance_val)
+        return self.register_watch(full_command, callback)
+
+    def register_watch(self,full_command,callback) -> int:
+        # returns host-side watch handle (unique for the lifetime of this connection)
+        with self.command_lock:
+            with self.watch_lock:
+                handle = self.next_watch_handle
+                self.next_watch_handle += 1
+                watch = self.watches[handle] = WatchState(handle, callback)
+                self.pending_watches.append((full_command.strip('<>'), handle))
+            slot_reply = self.query(full_command)
+
+            with self.watch_lock:
+                registered = watch.slot is not None
+                timed_out = any(h == handle for _,h in self.pending_watches)
+                if not registered:
+                    self.watches.pop(handle, None)
+                if timed_out:
+                    # keep waiting for a late slot number so the device-side watch can be cancelled
+                    self.pending_watches = collections.deque((echo, None if h == handle else h)
+                                                             for echo,h in self.pending_watches)
+            # slot number may have been claimed just after receive() timed out; keep replies in step
+            while registered and slot_reply != str(watch.slot):
+                slot_reply = self.receive()
+                if not slot_reply:
+                    break
+        if timed_out:
+            print("No reply to watch registration from Arduino (watch will be cancelled if one arrives later)")
+            raise RuntimeError
+        if not registered:
+            print("No free watch slots on Arduino (or invalid sensor index)! Received: %s" %(slot_reply))
+            raise RuntimeError
+        return handle
+
+    def cancel_watch(self,watch_handle=None):
+        # define serial commands and get command string
+        CANCEL_WATCH = "WC"         # command format: <WC, watch #, 999> (out-of-range watch # cancels all)
+        command_str = CANCEL_WATCH
+
+        # forget watch(es) on host side, waking anything waiting on them
+        with self.watch_lock:
+            if watch_handle is None:
+                slot = PneumaticConnection.FILLER_STRING
+                cancelled = list(self.watches.values())
+                self.watch_slots.clear()
+                self.watches.clear()
+            else:
+                slots = [s for s,h in self.watch_slots.items() if h == watch_handle]
+                if not slots:
+                    return  # already fired or cancelled
+                slot = slots[0]
+                del self.watch_slots[slot]
+                cancelled = [self.watches.pop(watch_handle)]
+        for watch in cancelled:
+            watch.cancel()
+
+        # send serial command
+        full_command = self.assemble_command(command_str,id=slot)
+        self.send(full_command)
+
+    def wait_for_watch(self,watch_handle,timeout=None):
+        # blocks until watch fires; returns pressure at firing (or None on timeout or cancellation)
+        with self.watch_lock:
+            watch = self.watches.get(watch_handle)
+        if watch is None:
+            return None
+        if not watch.fired.wait(timeout):
+            return None
+        with self.watch_lock:
+            self.watches.pop(watch_handle, None)
+        return watch.pressure
+
+    async def await_watch(self,watch_handle,timeout=None):
+        # asyncio equivalent of wait_for_watch (resolved by reader thread, so does not touch serial port)
+        with self.watch_lock:
+            watch = self.watches.get(watch_handle)
+        if watch is None:
+            return None
+        future = watch.add_future(asyncio.get_running_loop())
+        try:
+            pressure = await asyncio.wait_for(future, timeout)
+        except asyncio.TimeoutError:
+            return None
+        finally:
+            watch.remove_future(future)
+        with self.watch_lock:
+            self.watches.pop(watch_handle, None)
+        return pressure
+
     def switch_input_channel(self,valve_string,delay_time=5):
         # close all input valves then perform neutral evacuation
         self.set_valve_group(True, self.CLOSED)
@@ -167,17 +424,94 @@ class PneumaticConnection:
             raise ValueError
     
     def test_connection(self,test_string,verbose=True):
-        sent_successfully = self.send(test_string)
+        with self.command_lock:
+            sent_successfully = self.send(test_string)
+            returned = self.receive()
         if (not sent_successfully and verbose):
             print("Warning: sending data to Arduino microcontroller over serial appears to be broken")
 
-        returned = self.receive()
         if verbose: 
             print("When %s sent to Arduino, Arduino returned %s." %(test_string,str(returned)))
 
+    def start_recording(self,file_path):
+        # log every command, reply, and notification (with timestamps) to a binary file for later replay
+        self.stop_recording()
+        with self.record_lock:
+            self.recording_file = open(file_path, 'wb')
+            self.recording_file.write(RECORDING_HEADER.pack(RECORDING_MAGIC, RECORDING_VERSION))
+            self.recording_start_time = time.perf_counter_ns()//1000
+
+    def record(self,rec_type,text):
+        # called from both caller thread (commands) and reader thread (replies and notifications)
+        with self.record_lock:
+            if self.recording_file is None:
+                return
+            elapsed = time.perf_counter_ns()//1000 - self.recording_start_time
+            payload = text.encode('UTF8')
+            self.recording_file.write(RECORD_HEADER.pack(rec_type, elapsed, len(payload)))
+            self.recording_file.write(payload)
+
+    def stop_recording(self):
+        with self.record_lock:
+            if self.recording_file is not None:
+                self.recording_file.close()
+                self.recording_file = None
+
     def close(self):
+        self.reading = False
+        self.reader_thread.join()
+        self.callback_tasks.put(None)
+        if threading.current_thread() is not self.dispatch_thread:
+            self.dispatch_thread.join()
+        self.stop_recording()
         self.serial.close()
 
+class WatchState:
+    # result of a single device-side watch; fired from the reader thread (callback is run by the connection)
+    def __init__(self, handle, callback=None):
+        self.handle = handle
+        self.callback = callback
+        self.pressure = None
+        self.slot = None    # device slot, once registered
+        self.fired = threading.Event()
+        self.futures = []
+        self.lock = threading.Lock()
+
+    def fire(self, pressure) -> bool:
+        # returns False if watch had already fired or been cancelled
+        with self.lock:
+            if self.fired.is_set():
+                return False
+            self.pressure = pressure
+            self.fired.set()
+            futures,self.futures = self.futures,[]
+        for loop,future in futures:
+            if not loop.is_closed():
+                loop.call_soon_threadsafe(WatchState.resolve, future, pressure)
+        return True
+
+    def cancel(self):
+        # wake waiters with no pressure value (callback is not run)
+        self.fire(None)
+
+    def add_future(self, loop):
+        future = loop.create_future()
+        with self.lock:
+            if self.fired.is_set():
+                future.set_result(self.pressure)
+            else:
+                self.futures.append((loop, future))
+        return future
+
+    def remove_future(self, future):
+        with self.lock:
+            self.futures = [(loop, f) for loop,f in self.futures if f is not future]
+
+    @staticmethod
+    def resolve(future, pressure):
+        if not future.done():
+            future.set_result(pressure)
+
 def define_setup_indices(pneum_obj,num_out_channels=1):
     #define input-side pump indices
     pump_indices = {
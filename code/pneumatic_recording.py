@@ -0,0 +1,47 @@
+''' PNEUMATIC_RECORDING v1.0
+
+Created: 2024-03-04
+
+Defines the session recording file format written by PneumaticConnection.start_recording(), and reads
+recordings back. Has no dependencies outside the standard library, so that recordings can be replayed
+on a PC without pyserial installed.
+'''
+import struct
+
+# define session recording file format
+# (header: magic + version; records: type, microseconds since recording started, payload length, payload)
+RECORDING_MAGIC = b'PNRC'
+RECORDING_VERSION = 2
+RECORDING_HEADER = struct.Struct('<4sB')
+RECORD_HEADER = struct.Struct('<BQH')
+REC_COMMAND = 0 # command sent to Arduino
+REC_REPLY = 1   # reply (or command echo) received from Arduino
+REC_NOTIFY = 2  # unsolicited notification (e.g., watch sample) received from Arduino
+
+def read_recording(file_path):
+    # returns list of (time since recording start in us, record type, text) tuples
+    with open(file_path, 'rb') as f:
+        data = f.read()
+    if len(data) < RECORDING_HEADER.size:
+        print("File %s is not a pneumatics session recording (too short)" %(file_path))
+        raise ValueError
+    magic,version = RECORDING_HEADER.unpack_from(data, 0)
+    if magic != RECORDING_MAGIC or version != RECORDING_VERSION:
+        print("File %s is not a pneumatics session recording (or has an unsupported version)" %(file_path))
+        raise ValueError
+
+    records = []
+    offset = RECORDING_HEADER.size
+    while offset < len(data):
+        # recording may be cut short (e.g., by a crash during the session); keep all complete records
+        if offset + RECORD_HEADER.size > len(data):
+            break
+        rec_type,elapsed,length = RECORD_HEADER.unpack_from(data, offset)
+        if offset + RECORD_HEADER.size + length > len(data):
+            break
+        offset += RECORD_HEADER.size
+        records.append((elapsed, rec_type, data[offset:offset + length].decode('UTF8')))
+        offset += length
+    if offset < len(data):
+        print("Warning: recording %s is truncated; using %d complete records" %(file_path, len(records)))
+    return records
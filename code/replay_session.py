@@ -0,0 +1,207 @@
+''' REPLAY_SESSION v1.0
+
+Created: 2024-03-04
+
+Replays a session recorded with PneumaticConnection.start_recording() against a host build of an
+Arduino sketch (see Arduino/host_replay), using pressures reported during the session as sensor
+inputs. Reports valve/pump actions, loop rate, and command latency, and compares two sketch versions.
+
+Usage:
+    python replay_session.py session.pnrc [--sketch DIR] [--compare OTHER_DIR] [--actions]
+'''
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from pneumatic_recording import read_recording, REC_COMMAND, REC_REPLY, REC_NOTIFY
+
+CODE_DIR = os.path.dirname(os.path.abspath(__file__))
+HOST_DIR = os.path.join(CODE_DIR, 'Arduino', 'host_replay')
+DEFAULT_SKETCH_DIR = os.path.join(CODE_DIR, 'Arduino', 'minimal_pneumatics')
+END_PADDING_US = 100000 # keep running sketch after last recorded event to catch delayed actions
+
+# define commands whose replies (or notifications) carry pressure samples
+SAMPLE_COMMANDS = {'GI':'I', 'GO':'O'}
+WATCH_COMMANDS = {'WI':'I', 'WO':'O', 'WS':'I'}
+
+def split_command(text):
+    # returns (command code, index) for a command string like "<GI,1,99>", or None if text is not in that format
+    # (e.g., free text sent with PneumaticConnection.test_connection())
+    fields = text.strip().strip('<>').split(',')
+    try:
+        return fields[0].strip(),int(fields[1])
+    except (IndexError, ValueError):
+        return None
+
+def build_replay_events(records):
+    # convert recorded commands and pressure replies/notifications to harness events
+    events = []
+    pending = None      # (command code, index, echo text) awaiting a reply
+    watch_sensors = {}  # watch ID -> (side, sensor index)
+    for time_us,rec_type,text in records:
+        if rec_type == REC_COMMAND:
+            # commands that do not parse are still sent to the sketch, but their replies are not used as samples
+            events.append('C %d %s' %(time_us, text.rstrip('\n')))
+            command = split_command(text)
+            pending = None if command is None else command + (text.strip().strip('<>'),)
+        elif rec_type == REC_NOTIFY:
+            fields = text.split(',')
+            if len(fields) == 3 and fields[1].isdigit() and int(fields[1]) in watch_sensors:
+                side,index = watch_sensors.pop(int(fields[1]))
+                events.append('S %d %s %d %s' %(time_us, side, index, fields[2]))
+        elif rec_type == REC_REPLY and pending is not None:
+            code,index,echo = pending
+            if text == echo:
+                continue
+            if code in SAMPLE_COMMANDS:
+                events.append('S %d %s %d %s' %(time_us, SAMPLE_COMMANDS[code], index, text))
+            elif code in WATCH_COMMANDS and text.isdigit():
+                watch_sensors[int(text)] = (WATCH_COMMANDS[code], index)
+            pending = None
+
+    # sort sensor samples ahead of commands recorded at the same time
+    events.sort(key=lambda event: (int(event.split()[1]), event[0] != 'S'))
+    end_time = records[-1][0] + END_PADDING_US if records else END_PADDING_US
+    events.append('X %d' %(end_time))
+    return events
+
+def build_sketch(sketch_dir, build_dir):
+    # mimic the Arduino builder: generate prototypes for sketch functions, then include sketch and harness
+    ino_files = sorted(f for f in os.listdir(sketch_dir) if f.endswith('.ino'))
+    main_ino = os.path.basename(os.path.normpath(sketch_dir)) + '.ino'
+    if main_ino in ino_files:
+        ino_files.remove(main_ino)
+        ino_files.insert(0, main_ino)
+    prototype_pattern = re.compile(r'^((?:unsigned\s+)?[A-Za-z_]\w*[\s\*&]+)([A-Za-z_]\w*)\s*\(([^;{)]*)\)\s*\{', re.MULTILINE)
+    prototypes = []
+    for ino_file in ino_files:
+        with open(os.path.join(sketch_dir, ino_file)) as f:
+            for match in prototype_pattern.finditer(f.read()):
+                prototypes.append('%s%s(%s);' %(match.group(1), match.group(2), match.group(3)))
+
+    wrapper_path = os.path.join(build_dir, 'replay_wrapper.cpp')
+    with open(wrapper_path, 'w') as f:
+        f.write('#include "Arduino.h"\n')
+        f.write('\n'.join(prototypes) + '\n')
+        for ino_file in ino_files:
+            f.write('#include "%s"\n' %(os.path.join(os.path.abspath(sketch_dir), ino_file)))
+        f.write('#include "%s"\n' %(os.path.join(HOST_DIR, 'host_replay.cpp')))
+
+    binary_path = os.path.join(build_dir, 'replay_host')
+    compiler = os.environ.get('CXX', 'g++')
+    subprocess.run([compiler, '-std=c++11', '-O2', '-Wall', '-Wextra', '-I', HOST_DIR, '-I', os.path.abspath(sketch_dir),
+                    wrapper_path, '-o', binary_path], check=True)
+    return binary_path
+
+def run_replay(binary_path, events):
+    result = subprocess.run([binary_path], input='\n'.join(events) + '\n', capture_output=True, text=True, check=True)
+    actions,lines,summary = [],[],None
+    for line in result.stdout.splitlines():
+        fields = line.split(' ', 2)
+        if fields[0] == 'A':
+            pin,value = fields[2].split()
+            actions.append((int(fields[1]), int(pin), int(value)))
+        elif fields[0] == 'L':
+            lines.append((int(fields[1]), fields[2] if len(fields) > 2 else ''))
+        elif fields[0] == 'R':
+            loops,sim_us,host_ns = [int(x) for x in line.split()[1:]]
+            summary = {'loops':loops, 'sim_us':sim_us, 'host_ns':host_ns}
+    return actions,lines,summary
+
+def command_latencies(events, lines):
+    # latency from command being sent to the sketch echoing it back (i.e., command received and parsed)
+    latencies = []
+    line_ind = 0
+    for event in events:
+        if not event.startswith('C '):
+            continue
+        _,time_us,text = event.split(' ', 2)
+        echo = text.strip().strip('<>')
+        # commands that are never echoed (e.g., missing start marker) are skipped without consuming lines
+        match_ind = line_ind
+        while match_ind < len(lines) and not (lines[match_ind][0] >= int(time_us) and lines[match_ind][1] == echo):
+            match_ind += 1
+        if match_ind < len(lines):
+            latencies.append(lines[match_ind][0] - int(time_us))
+            line_ind = match_ind + 1
+    return latencies
+
+def summarize(name, events, actions, lines, summary):
+    latencies = command_latencies(events, lines)
+    stats = {
+        'loop_rate': summary['loops']/(summary['sim_us']/1e6) if summary['sim_us'] else 0.,
+        'host_ns_per_loop': summary['host_ns']/summary['loops'] if summary['loops'] else 0.,
+        'mean_latency_us': sum(latencies)/len(latencies) if latencies else 0.,
+        'max_latency_us': max(latencies) if latencies else 0,
+        'num_actions': len(actions),
+        'num_lines': len(lines),
+    }
+    print("%s:" %(name))
+    print("  loop rate: %.1f loops/s (simulated), %.0f ns/loop (host)" %(stats['loop_rate'], stats['host_ns_per_loop']))
+    print("  command latency: mean %.0f us, max %d us (%d of %d commands echoed)"
+          %(stats['mean_latency_us'], stats['max_latency_us'], len(latencies), sum(e.startswith('C ') for e in events)))
+    print("  %d pin actions, %d serial lines" %(stats['num_actions'], stats['num_lines']))
+    return stats
+
+def compare_actions(actions_a, actions_b):
+    # compare order of (pin, value) actions and timing of matching actions
+    seq_a = [(pin, value) for _,pin,value in actions_a]
+    seq_b = [(pin, value) for _,pin,value in actions_b]
+    first_diff = next((i for i in range(min(len(seq_a), len(seq_b))) if seq_a[i] != seq_b[i]), None)
+    if first_diff is None and len(seq_a) != len(seq_b):
+        first_diff = min(len(seq_a), len(seq_b))
+    num_matching = len(seq_a) if first_diff is None else first_diff
+    shifts = [actions_b[i][0] - actions_a[i][0] for i in range(num_matching)]
+
+    if first_diff is None:
+        print("Pin actions match (%d actions)" %(len(seq_a)))
+    else:
+        print("Pin actions diverge at action %d:" %(first_diff))
+        for name,actions in (('A', actions_a), ('B', actions_b)):
+            if first_diff < len(actions):
+                print("  %s: t=%d us, pin %d -> %d" %((name,) + actions[first_diff]))
+            else:
+                print("  %s: (no further actions)" %(name))
+    if shifts:
+        print("Timing shift of matching actions (B - A): mean %.0f us, max %d us"
+              %(sum(shifts)/len(shifts), max(shifts, key=abs)))
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a recorded pneumatics session against host builds of the Arduino sketch.")
+    parser.add_argument('recording', help="session file written by PneumaticConnection.start_recording()")
+    parser.add_argument('--sketch', default=DEFAULT_SKETCH_DIR, help="sketch directory to replay against (A)")
+    parser.add_argument('--compare', help="second sketch directory (B), e.g. a git worktree of another firmware version")
+    parser.add_argument('--actions', action='store_true', help="print every pin action")
+    args = parser.parse_args()
+
+    events = build_replay_events(read_recording(args.recording))
+    results = []
+    with tempfile.TemporaryDirectory() as build_dir:
+        for name,sketch_dir in (('A', args.sketch), ('B', args.compare)):
+            if sketch_dir is None:
+                continue
+            sketch_build_dir = os.path.join(build_dir, name)
+            os.mkdir(sketch_build_dir)
+            binary_path = build_sketch(sketch_dir, sketch_build_dir)
+            actions,lines,summary = run_replay(binary_path, events)
+            stats = summarize('%s (%s)' %(name, sketch_dir), events, actions, lines, summary)
+            if args.actions:
+                for action in actions:
+                    print("  t=%d us, pin %d -> %d" %action)
+            results.append((actions, stats))
+
+    if len(results) == 2:
+        (actions_a,stats_a),(actions_b,stats_b) = results
+        print("Differences (B - A):")
+        print("  loop rate: %+.1f loops/s" %(stats_b['loop_rate'] - stats_a['loop_rate']))
+        print("  host time: %+.0f ns/loop" %(stats_b['host_ns_per_loop'] - stats_a['host_ns_per_loop']))
+        print("  command latency: mean %+.0f us, max %+d us"
+              %(stats_b['mean_latency_us'] - stats_a['mean_latency_us'], stats_b['max_latency_us'] - stats_a['max_latency_us']))
+        compare_actions(actions_a, actions_b)
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())